@@ -16,7 +16,11 @@
 */
 // {{{ includes
 #include <arpa/inet.h>
+#include <atomic>
 #include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
 #include <ctime>
 #include <iostream>
 #include <list>
@@ -27,6 +31,7 @@
 #include <poll.h>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 using namespace std;
 #include <Central>
@@ -44,11 +49,23 @@ using namespace common;
 /*! \def mUSAGE(A)
 * \brief Prints the usage statement.
 */
-#define mUSAGE(A) cout << endl << "Usage:  "<< A << " [options]"  << endl << endl << " -c, --conf" << endl << "     Sets the configuration directory." << endl << endl << " -d, --daemon" << endl << "     Turns the process into a daemon." << endl << endl << "     --data" << endl << "     Sets the data directory." << endl << endl << " -e EMAIL, --email=EMAIL" << endl << "     Provides the email address for default notifications." << endl << endl << " -h, --help" << endl << "     Displays this usage screen." << endl << endl << " -v, --version" << endl << "     Displays the current version of this software." << endl << endl
+#define mUSAGE(A) cout << endl << "Usage:  "<< A << " [options]"  << endl << endl << " -c, --conf" << endl << "     Sets the configuration directory." << endl << endl << "     --coordinator" << endl << "     Runs the cluster throttle coordinator." << endl << endl << " -d, --daemon" << endl << "     Turns the process into a daemon." << endl << endl << "     --data" << endl << "     Sets the data directory." << endl << endl << " -e EMAIL, --email=EMAIL" << endl << "     Provides the email address for default notifications." << endl << endl << " -h, --help" << endl << "     Displays this usage screen." << endl << endl << " -p PORT, --port=PORT" << endl << "     Sets the listening port." << endl << endl << " -v, --version" << endl << "     Displays the current version of this software." << endl << endl
 /*! \def mVER_USAGE(A,B)
 * \brief Prints the version number.
 */
 #define mVER_USAGE(A,B) cout << endl << A << " Version: " << B << endl << endl
+/*! \def CLUSTER
+* \brief Supplies the cluster coordinator port.
+*/
+#define CLUSTER "7679"
+/*! \def IDLE
+* \brief Contains the number of seconds an idle multiplexed connection is kept open.
+*/
+#define IDLE 60
+/*! \def LEASE
+* \brief Contains the number of seconds a cluster lease is held without renewal.
+*/
+#define LEASE 10
 /*! \def PID
 * \brief Contains the PID path.
 */
@@ -65,7 +82,7 @@ using namespace common;
 // {{{ structs
 struct bridge
 {
-  bool bDone;
+  bool bMultiplex;
   int fdIncoming;
   int fdOutgoing;
   int nThrottle;
@@ -73,6 +90,7 @@ struct bridge
   size_t unInSend;
   size_t unOutRecv;
   size_t unOutSend;
+  size_t unShard;
   string strBuffer[2];
   string strLoadBalancer;
   string strPort;
@@ -81,24 +99,88 @@ struct bridge
   time_t CActiveTime;
   time_t CEndTime;
   time_t CStartTime;
+  list<bridge *>::iterator iActive;
   Json *ptInfo;
 };
+struct claim
+{
+  size_t unActive;
+  size_t unGrant;
+  size_t unWant;
+  time_t CExpire;
+};
+struct connection
+{
+  bool bReused;
+  int fdSocket;
+  string strBuffer;
+  string strServer;
+  time_t CTime;
+};
+struct lease
+{
+  int nThrottle;
+  size_t unActive;
+  size_t unDemand;
+  size_t unGrant;
+  size_t unRequested;
+  size_t unWant;
+  time_t CExpire;
+  time_t CUsed;
+};
+struct pool
+{
+  atomic<int> nGrant;
+  atomic<size_t> unOpen;
+  atomic<size_t> unWaiting;
+  list<connection *> idle;
+};
 struct service
 {
+  bool bMultiplex;
+  int nGrant;
+  int nThrottle;
+  size_t unDeficit;
+  size_t unWeight;
   list<bridge *> active;
   list<bridge *> queue;
+  pool *ptPool;
+};
+struct shard
+{
+  condition_variable condition;
+  list<bridge *> completed;
+  list<bridge *> load;
+  map<string, lease *> leases;
+  mutex mutexLease;
+  mutex mutexShard;
+  string strRound;
+  unordered_map<string, service *> services;
 };
 // }}}
 // {{{ global variables
+static bool gbCoordinator = false; //!< Global cluster coordinator variable.
 static bool gbDaemon = false; //!< Global daemon variable.
+static bool gbSharded = false; //!< Global alert variable for a Global Throttle configured under multiple schedulers.
 static bool gbShutdown = false; //!< Global shutdown variable.
-static list<bridge *> loadBridge; //!< Global bridge entry data.
-static map<string, service *> services; //!< Global services variable.
+static map<string, map<string, claim *> > claims; //!< Global cluster claims by service and node.
+static map<string, pool *> pools; //!< Global multiplexed connection pools.
 static string gstrApplication = "Port Concentrator"; //!< Global application name.
 static string gstrData = "/data/portconcentrator"; //!< Global data path.
 static string gstrEmail; //!< Global notification email address.
+static string gstrNode; //!< Global cluster node name.
+static string gstrPort = PORT; //!< Global listening port.
+static vector<shard *> shards; //!< Global scheduler shards.
+atomic<bool> gbCluster(false); //!< Global cluster configured variable.
+atomic<bool> gbClusterReachable(false); //!< Global cluster coordinator reachability.
+atomic<int> gnNodes(1); //!< Global cluster node count used when the coordinator is unreachable.
+atomic<size_t> gunFreed(0); //!< Global count of wakeups for freed outgoing connection slots.
+atomic<size_t> gunGlobalThrottle(0); //!< Global Throttle shared by every service.
+atomic<size_t> gunOutgoing(0); //!< Global number of outgoing connections held by bridges and pools.
 static Central *gpCentral = NULL; //!< Contains the Central class.
-mutex mutexLoad; //! < Contains the loadBridge mutex.
+condition_variable conditionPool; //!< Signals a released multiplexed connection.
+mutex mutexClaim; //!< Contains the claims mutex.
+mutex mutexPool; //!< Contains the pools mutex.
 // }}}
 // {{{ prototypes
 /*! \fn void sighandle(const int nSignal)
@@ -111,15 +193,127 @@ void sighandle(const int nSignal);
 * \param ptBridge Contains the bridge.
 */
 void active(bridge *ptBridge);
+/*! \fn connection *borrow(bridge *ptBridge, pool *ptPool, const bool bNew, string &strError)
+* \brief Borrows an idle or new connection from a multiplexed pool.
+* \param ptBridge Contains the bridge.
+* \param ptPool Contains the pool.
+* \param bNew Determines whether a newly opened connection is required.
+* \param strError Contains the error message.
+* \return Returns the connection or NULL on error.
+*/
+connection *borrow(bridge *ptBridge, pool *ptPool, const bool bNew, string &strError);
+/*! \fn void cluster()
+* \brief Renews the cluster leases with the coordinator.
+*/
+void cluster();
+/*! \fn void configure()
+* \brief Loads the scheduler settings from the configuration.
+*/
+void configure();
+/*! \fn void coordinate(int fdSocket)
+* \brief Grants cluster leases to a node.
+* \param fdSocket Contains the node socket descriptor.
+*/
+void coordinate(int fdSocket);
+/*! \fn void coordinator()
+* \brief Listens for cluster nodes.
+*/
+void coordinator();
+/*! \fn size_t digest(const string strValue)
+* \brief Hashes a service name to pick its scheduler shard.
+* \param strValue Contains the service name.
+* \return Returns the FNV-1a hash.
+*/
+size_t digest(const string strValue);
+/*! \fn bool evict()
+* \brief Closes the longest idle multiplexed connection to free its Global Throttle slot.  The caller holds mutexPool.
+* \return Returns a boolean true/false value.
+*/
+bool evict();
+/*! \fn bool exchange(bridge *ptBridge, connection *ptConnection, const string strRequest, string &strResponse, string &strError)
+* \brief Sends one request line over a multiplexed connection and receives one response line.
+* \param ptBridge Contains the bridge.
+* \param ptConnection Contains the connection.
+* \param strRequest Contains the request line.
+* \param strResponse Contains the response line.
+* \param strError Contains the error message.
+* \return Returns a boolean true/false value.
+*/
+bool exchange(bridge *ptBridge, connection *ptConnection, const string strRequest, string &strResponse, string &strError);
+/*! \fn bool fits(service *ptService, bridge *ptBridge)
+* \brief Determines whether a queued bridge fits within its throttle and cluster grant.
+* \param ptService Contains the service.
+* \param ptBridge Contains the bridge.
+* \return Returns a boolean true/false value.
+*/
+bool fits(service *ptService, bridge *ptBridge);
+/*! \fn size_t launch(service *ptService, const size_t unLimit)
+* \brief Activates queued bridges that fit within their throttle.
+* \param ptService Contains the service.
+* \param unLimit Contains the maximum number of bridges to activate.
+* \return Returns the number of bridges activated.
+*/
+size_t launch(service *ptService, const size_t unLimit);
+/*! \fn pool *lookup(const string strService)
+* \brief Finds or creates the multiplexed pool of a service.
+* \param strService Contains the service.
+* \return Returns the pool.
+*/
+pool *lookup(const string strService);
+/*! \fn void maintain()
+* \brief Refreshes the scheduler settings and closes idle multiplexed connections.
+*/
+void maintain();
+/*! \fn void multiplex(bridge *ptBridge)
+* \brief Carries the bridge requests over the multiplexed connection pool.
+* \param ptBridge Contains the bridge.
+*/
+void multiplex(bridge *ptBridge);
+/*! \fn bool outgoing(bridge *ptBridge, int &fdSocket, string &strConnected, string &strError)
+* \brief Connects to the first available outgoing server.
+* \param ptBridge Contains the bridge.
+* \param fdSocket Contains the connected socket descriptor.
+* \param strConnected Contains the connected server.
+* \param strError Contains the error message.
+* \return Returns a boolean true/false value.
+*/
+bool outgoing(bridge *ptBridge, int &fdSocket, string &strConnected, string &strError);
 /*! \fn void *queue(int fdSocket)
 * \brief Adds a socket to the queue.
 * \param fdSocket Contains socket descriptor.
 */
 void queue(int fdSocket);
-/*! \fn void throttle()
-* \brief Maintains the various socket throttles.
+/*! \fn void release(pool *ptPool, connection *ptConnection, const bool bReuse)
+* \brief Returns a connection to a multiplexed pool.
+* \param ptPool Contains the pool.
+* \param ptConnection Contains the connection.
+* \param bReuse Determines whether the connection is kept open.
+*/
+void release(pool *ptPool, connection *ptConnection, const bool bReuse);
+/*! \fn size_t reserve(const size_t unWant, const size_t unCapacity)
+* \brief Reserves global outgoing connection slots.
+* \param unWant Contains the number of slots wanted.
+* \param unCapacity Contains the Global Throttle.
+* \return Returns the number of slots reserved.
 */
-void throttle();
+size_t reserve(const size_t unWant, const size_t unCapacity);
+/*! \fn void throttle(const size_t unShard)
+* \brief Maintains the socket throttles for the services in one shard.
+* \param unShard Contains the shard index.
+*/
+void throttle(const size_t unShard);
+/*! \fn bool transmit(int fdSocket, const string strLine)
+* \brief Writes an entire line to a socket.
+* \param fdSocket Contains the socket descriptor.
+* \param strLine Contains the line.
+* \return Returns a boolean true/false value.
+*/
+bool transmit(int fdSocket, const string strLine);
+/*! \fn void vacate(const size_t unSlots)
+* \brief Frees global outgoing connection slots and wakes the schedulers.
+* \param unSlots Contains the number of slots freed.
+*/
+void vacate(const size_t unSlots);
 // }}}
 // {{{ main()
 /*! \fn int main(int argc, char *argv[])
@@ -158,6 +352,10 @@ int main(int argc, char *argv[])
       gpCentral->manip()->purgeChar(strConf, strConf, "\"");
       gpCentral->utility()->setConfPath(strConf, strError);
     } 
+    else if (strArg == "--coordinator")
+    {
+      gbCoordinator = true;
+    }
     else if (strArg == "-d" || strArg == "--daemon")
     { 
       gbDaemon = true;
@@ -186,6 +384,19 @@ int main(int argc, char *argv[])
       mUSAGE(argv[0]);
       return 0;
     }
+    else if (strArg == "-p" || (strArg.size() > 7 && strArg.substr(0, 7) == "--port="))
+    {
+      if (strArg == "-p" && i + 1 < argc && argv[i+1][0] != '-')
+      {
+        gstrPort = argv[++i];
+      }
+      else
+      {
+        gstrPort = strArg.substr(7, strArg.size() - 7);
+      }
+      gpCentral->manip()->purgeChar(gstrPort, gstrPort, "'");
+      gpCentral->manip()->purgeChar(gstrPort, gstrPort, "\"");
+    }
     else if (strArg == "-v" || strArg == "--version")
     {
       mVER_USAGE(argv[0], VERSION);
@@ -230,14 +441,55 @@ int main(int argc, char *argv[])
       outPid.close();
       ofstream outStart((gstrData + START).c_str());
       outStart.close();
-      thread tThread(throttle);
-      pthread_setname_np(tThread.native_handle(), "throttle");
-      tThread.detach();
+      char szHost[256] = "\0";
+      gethostname(szHost, sizeof(szHost) - 1);
+      Json *ptConf = gpCentral->utility()->conf();
+      size_t unShards = thread::hardware_concurrency();
+      gstrNode = (string)szHost + (string)":" + gstrPort;
+      if (ptConf->m.find("Schedulers") != ptConf->m.end() && atoi(ptConf->m["Schedulers"]->v.c_str()) > 0)
+      {
+        unShards = atoi(ptConf->m["Schedulers"]->v.c_str());
+      }
+      if (unShards == 0)
+      {
+        unShards = 1;
+      }
+      configure();
+      // weighted sharing of the Global Throttle needs every service on one scheduler
+      if (unShards > 1 && gunGlobalThrottle > 0)
+      {
+        stringstream ssMessage;
+        ssMessage << "Running 1 scheduler instead of " << unShards << " because the Global Throttle is shared across every service.";
+        gpCentral->log(ssMessage.str(), strError);
+        unShards = 1;
+      }
+      for (size_t i = 0; i < unShards; i++)
+      {
+        shards.push_back(new shard);
+      }
+      for (size_t i = 0; i < unShards; i++)
+      {
+        thread tThread(throttle, i);
+        pthread_setname_np(tThread.native_handle(), "throttle");
+        tThread.detach();
+      }
+      thread tMaintain(maintain);
+      pthread_setname_np(tMaintain.native_handle(), "maintain");
+      tMaintain.detach();
+      thread tCluster(cluster);
+      pthread_setname_np(tCluster.native_handle(), "cluster");
+      tCluster.detach();
+      if (gbCoordinator)
+      {
+        thread tCoordinator(coordinator);
+        pthread_setname_np(tCoordinator.native_handle(), "coordinator");
+        tCoordinator.detach();
+      }
       memset(&hints, 0, sizeof(struct addrinfo));
       hints.ai_family = AF_INET6;
       hints.ai_socktype = SOCK_STREAM;
       hints.ai_flags = AI_PASSIVE;
-      if ((nReturn = getaddrinfo(NULL, PORT, &hints, &result)) == 0)
+      if ((nReturn = getaddrinfo(NULL, gstrPort.c_str(), &hints, &result)) == 0)
       {
         bool bBound = false, bSocket = false;
         int fdSocket;
@@ -319,87 +571,14 @@ int main(int argc, char *argv[])
 // {{{ active()
 void active(bridge *ptBridge)
 {
-  bool bAddrInfo = false, bConnected = false, bSocket = false;
-  int nReturn;
-  list<string> serverGroup;
   string strError;
   stringstream ssMessage;
 
-  if (!ptBridge->strServer.empty())
-  {
-    serverGroup.push_back(ptBridge->strServer);
-  }
-  else
-  {
-    if (!ptBridge->strLoadBalancer.empty())
-    {
-      serverGroup.push_back(ptBridge->strLoadBalancer);
-    }
-    if (!ptBridge->strServiceJunction.empty())
-    {
-      serverGroup.push_back(ptBridge->strServiceJunction);
-    }
-  }
-  if (!serverGroup.empty())
+  if (ptBridge->bMultiplex)
   {
-    for (auto i = serverGroup.begin(); !bConnected && i != serverGroup.end(); i++)
-    {
-      string strServer;
-      timeval tTimeVal;
-      unsigned int unAttempt = 0, unPick = 0, unSeed = time(NULL);
-      vector<string> server;
-      tTimeVal.tv_sec = 2;
-      tTimeVal.tv_usec = 0;
-      for (int j = 1; !gpCentral->manip()->getToken(strServer, (*i), j, ",", true).empty(); j++)
-      {
-        server.push_back(gpCentral->manip()->trim(strServer, strServer));
-      }
-      srand(unSeed);
-      unPick = rand_r(&unSeed) % server.size();
-      bAddrInfo = bSocket = false;
-      while (!bConnected && unAttempt++ < server.size())
-      {
-        struct addrinfo hints, *result;
-        if (unPick == server.size())
-        {
-          unPick = 0;
-        }
-        strServer = server[unPick];
-        memset(&hints, 0, sizeof(struct addrinfo));
-        hints.ai_family = AF_UNSPEC;
-        hints.ai_socktype = SOCK_STREAM;
-        hints.ai_flags = 0;
-        hints.ai_protocol = 0;
-        bAddrInfo = bSocket = false;
-        if ((nReturn = getaddrinfo(strServer.c_str(), ptBridge->strPort.c_str(), &hints, &result)) == 0)
-        {
-          struct addrinfo *rp;
-          bAddrInfo = true;
-          for (rp = result; !bConnected && rp != NULL; rp = rp->ai_next)
-          {
-            if ((ptBridge->fdOutgoing = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol)) >= 0)
-            {
-              bSocket = true;
-              setsockopt(ptBridge->fdOutgoing, SOL_SOCKET, SO_RCVTIMEO, &tTimeVal, sizeof(timeval));
-              if (connect(ptBridge->fdOutgoing, rp->ai_addr, rp->ai_addrlen) == 0)
-              {
-                bConnected = true;
-                ptBridge->strServer = strServer;
-              }
-              else
-              {
-                close(ptBridge->fdOutgoing);
-              }
-            }
-          }
-          freeaddrinfo(result);
-        }
-        unPick++;
-      }
-    }
-    serverGroup.clear();
+    multiplex(ptBridge);
   }
-  if (bConnected)
+  else if (outgoing(ptBridge, ptBridge->fdOutgoing, ptBridge->strServer, strError))
   {
     bool bExit = false;
     char szBuffer[65536];
@@ -520,108 +699,1020 @@ void active(bridge *ptBridge)
   }
   else
   {
-    stringstream ssMessage;
-    if (!bAddrInfo)
+    ptBridge->ptInfo->insert("Error", strError);
+  }
+  close(ptBridge->fdIncoming);
+  shards[ptBridge->unShard]->mutexShard.lock();
+  shards[ptBridge->unShard]->completed.push_back(ptBridge);
+  shards[ptBridge->unShard]->mutexShard.unlock();
+  shards[ptBridge->unShard]->condition.notify_one();
+}
+// }}}
+// {{{ borrow()
+connection *borrow(bridge *ptBridge, pool *ptPool, const bool bNew, string &strError)
+{
+  connection *ptConnection = NULL;
+  size_t unGlobalThrottle = gunGlobalThrottle;
+  time_t CTime[2];
+  unique_lock<mutex> lock(mutexPool);
+
+  time(&(CTime[0]));
+  ptPool->unWaiting++;
+  while (ptConnection == NULL && strError.empty())
+  {
+    int nLimit = ptBridge->nThrottle, nGrant = ptPool->nGrant;
+    // the cluster grant published by the scheduler further caps the pool
+    if (nGrant >= 0)
     {
-      ssMessage << "getaddrinfo() error:  " << gai_strerror(nReturn);
+      nLimit = min(nLimit, nGrant);
     }
-    else
+    if (!bNew && !ptPool->idle.empty())
     {
-      if (!bSocket)
+      pollfd fds[1];
+      // the most recently used connection is reused first so that surplus ones age out
+      ptConnection = ptPool->idle.back();
+      ptPool->idle.pop_back();
+      fds[0].fd = ptConnection->fdSocket;
+      fds[0].events = POLLIN;
+      // an idle connection should have nothing buffered or to read unless the server closed it
+      if (!ptConnection->strBuffer.empty() || poll(fds, 1, 0) != 0)
       {
-        ssMessage << "socket()";
+        close(ptConnection->fdSocket);
+        delete ptConnection;
+        ptConnection = NULL;
+        ptPool->unOpen--;
+        vacate(1);
       }
       else
       {
-        ssMessage << "connect()";
+        ptConnection->bReused = true;
+      }
+    }
+    // a new connection also needs a slot under the Global Throttle, taken from an idle connection if necessary
+    else if ((int)ptPool->unOpen < nLimit && (unGlobalThrottle == 0 || reserve(1, unGlobalThrottle) == 1 || (evict() && reserve(1, unGlobalThrottle) == 1)))
+    {
+      int fdSocket;
+      string strServer;
+      if (unGlobalThrottle == 0)
+      {
+        gunOutgoing++;
+      }
+      ptPool->unOpen++;
+      lock.unlock();
+      if (outgoing(ptBridge, fdSocket, strServer, strError))
+      {
+        ptConnection = new connection;
+        ptConnection->bReused = false;
+        ptConnection->fdSocket = fdSocket;
+        ptConnection->strServer = strServer;
+      }
+      lock.lock();
+      if (ptConnection == NULL)
+      {
+        ptPool->unOpen--;
+        vacate(1);
+        conditionPool.notify_all();
+      }
+    }
+    // make room for a required new connection by closing an idle one
+    else if (bNew && !ptPool->idle.empty())
+    {
+      close(ptPool->idle.front()->fdSocket);
+      delete ptPool->idle.front();
+      ptPool->idle.pop_front();
+      ptPool->unOpen--;
+      vacate(1);
+    }
+    else
+    {
+      conditionPool.wait_for(lock, chrono::milliseconds(250));
+      time(&(CTime[1]));
+      if (gbShutdown)
+      {
+        strError = "Shutting down.";
+      }
+      else if ((CTime[1] - CTime[0]) > 600)
+      {
+        strError = "error:  Exceeded 10 minute timeout.";
       }
-      ssMessage << ":  " << strerror(errno);
     }
-    ptBridge->ptInfo->insert("Error", ssMessage.str());
   }
-  close(ptBridge->fdIncoming);
-  ptBridge->bDone = true;
+  ptPool->unWaiting--;
+
+  return ptConnection;
 }
 // }}}
-// {{{ queue()
-void queue(int fdSocket)
+// {{{ cluster()
+void cluster()
 {
-  bool bValid = false;
-  char szIP[INET6_ADDRSTRLEN];
-  sockaddr_storage addr;
-  socklen_t len = sizeof(addr);
-  string strRequest;
+  int fdSocket = -1;
+  string strError;
+  time_t CLease = LEASE, CRenew = 0;
 
-  getpeername(fdSocket, (sockaddr*)&addr, &len);
-  if (addr.ss_family == AF_INET)
-  {
-    sockaddr_in *s = (sockaddr_in *)&addr;
-    inet_ntop(AF_INET, &s->sin_addr, szIP, sizeof(szIP));
-  }
-  else if (addr.ss_family == AF_INET6)
-  {
-    sockaddr_in6 *s = (sockaddr_in6 *)&addr;
-    inet_ntop(AF_INET6, &s->sin6_addr, szIP, sizeof(szIP));
-  }
-  if (gpCentral->utility()->getLine(fdSocket, strRequest))
+  while (!gbShutdown)
   {
-    map<string, string> request;
-    Json *ptConf = gpCentral->utility()->conf(), *ptJson = new Json(strRequest);
-    ptJson->flatten(request, true, false);
-    delete ptJson;
-    if (request.find("Service") != request.end() && !request["Service"].empty() && request.find("Throttle") != request.end() && !request["Throttle"].empty() && atoi(request["Throttle"].c_str()) > 0 && (request.find("Server") == request.end() || request["Server"].empty() || (request.find("Port") != request.end() && !request["Port"].empty())))
+    Json *ptConf = gpCentral->utility()->conf();
+    if (ptConf->m.find("Cluster") != ptConf->m.end() && ptConf->m["Cluster"]->m.find("Coordinator") != ptConf->m["Cluster"]->m.end() && !ptConf->m["Cluster"]->m["Coordinator"]->v.empty())
     {
-      bridge *ptBridge = new bridge;
-      bValid = true;
-      ptBridge->bDone = false;
-      ptBridge->unInRecv = 0;
-      ptBridge->unInSend = 0;
-      ptBridge->unOutRecv = 0;
-      ptBridge->unOutSend = 0;
-      ptBridge->ptInfo = new Json(request);
-      if (request.find("Server") != request.end() && !request["Server"].empty())
+      bool bRenew = false;
+      size_t unBatch = 1;
+      time_t CTime;
+      Json *ptRequest = new Json;
+      if (ptConf->m["Cluster"]->m.find("Batch") != ptConf->m["Cluster"]->m.end() && atoi(ptConf->m["Cluster"]->m["Batch"]->v.c_str()) > 0)
       {
-        ptBridge->strServer = request["Server"];
-        ptBridge->strPort = request["Port"];
+        unBatch = atoi(ptConf->m["Cluster"]->m["Batch"]->v.c_str());
       }
-      else
+      time(&CTime);
+      ptRequest->insert("Node", gstrNode);
+      ptRequest->m["Services"] = new Json;
+      for (auto &ptShard : shards)
       {
-        if (ptConf->m.find("Load Balancer") != ptConf->m.end() && !ptConf->m["Load Balancer"]->v.empty())
+        ptShard->mutexLease.lock();
+        for (auto &i : ptShard->leases)
         {
-          ptBridge->strLoadBalancer = ptConf->m["Load Balancer"]->v;
+          stringstream ssActive, ssThrottle, ssWant;
+          // ask for a batch beyond the current demand so that admission stays local
+          i.second->unWant = min((size_t)i.second->nThrottle, i.second->unDemand + unBatch);
+          if (i.second->unDemand == 0 && (CTime - i.second->CUsed) > LEASE)
+          {
+            i.second->unWant = 0;
+          }
+          // renew early only for a changed want or a grant about to run out, otherwise on the regular interval
+          if (i.second->unWant != i.second->unRequested || (i.second->CExpire - CTime) <= 1)
+          {
+            bRenew = true;
+          }
+          ptRequest->m["Services"]->m[i.first] = new Json;
+          ssActive << i.second->unActive;
+          ptRequest->m["Services"]->m[i.first]->insert("Active", ssActive.str(), 'n');
+          ssThrottle << i.second->nThrottle;
+          ptRequest->m["Services"]->m[i.first]->insert("Throttle", ssThrottle.str(), 'n');
+          ssWant << i.second->unWant;
+          ptRequest->m["Services"]->m[i.first]->insert("Want", ssWant.str(), 'n');
         }
-        if (ptConf->m.find("Service Junction") != ptConf->m.end() && !ptConf->m["Service Junction"]->v.empty())
+        ptShard->mutexLease.unlock();
+      }
+      // renew well inside the lease length the coordinator last handed out
+      if (bRenew || (CTime - CRenew) >= max((time_t)1, CLease / 3))
+      {
+        string strLine;
+        stringstream ssRequest;
+        if (fdSocket == -1)
         {
-          ptBridge->strServiceJunction = ptConf->m["Service Junction"]->v;
+          bridge tCoordinator;
+          string strServer;
+          tCoordinator.strServer = ptConf->m["Cluster"]->m["Coordinator"]->v;
+          tCoordinator.strPort = CLUSTER;
+          if (ptConf->m["Cluster"]->m.find("Port") != ptConf->m["Cluster"]->m.end() && !ptConf->m["Cluster"]->m["Port"]->v.empty())
+          {
+            tCoordinator.strPort = ptConf->m["Cluster"]->m["Port"]->v;
+          }
+          if (!outgoing(&tCoordinator, fdSocket, strServer, strError))
+          {
+            fdSocket = -1;
+          }
         }
-        ptBridge->strPort = "5864";
+        ssRequest << ptRequest << endl;
+        if (fdSocket != -1 && transmit(fdSocket, ssRequest.str()) && gpCentral->utility()->getLine(fdSocket, strLine))
+        {
+          Json *ptResponse = new Json(strLine);
+          if (ptResponse->m.find("Lease") != ptResponse->m.end() && atoi(ptResponse->m["Lease"]->v.c_str()) > 0)
+          {
+            CLease = atoi(ptResponse->m["Lease"]->v.c_str());
+          }
+          gbClusterReachable = true;
+          if (ptResponse->m.find("Services") != ptResponse->m.end())
+          {
+            for (auto &ptShard : shards)
+            {
+              list<map<string, lease *>::iterator> removeLease;
+              ptShard->mutexLease.lock();
+              for (auto i = ptShard->leases.begin(); i != ptShard->leases.end(); i++)
+              {
+                if (ptResponse->m["Services"]->m.find(i->first) != ptResponse->m["Services"]->m.end())
+                {
+                  i->second->unGrant = atoi(ptResponse->m["Services"]->m[i->first]->v.c_str());
+                  i->second->unRequested = i->second->unWant;
+                  // measured from before the request so the node lets go before the coordinator does
+                  i->second->CExpire = CTime + CLease;
+                  if (i->second->unWant == 0 && i->second->unGrant == 0 && i->second->unDemand == 0)
+                  {
+                    delete i->second;
+                    removeLease.push_back(i);
+                  }
+                }
+              }
+              for (auto &i : removeLease)
+              {
+                ptShard->leases.erase(i);
+              }
+              removeLease.clear();
+              ptShard->mutexLease.unlock();
+            }
+          }
+          delete ptResponse;
+          CRenew = CTime;
+        }
+        else
+        {
+          if (fdSocket != -1)
+          {
+            close(fdSocket);
+            fdSocket = -1;
+          }
+          if (gbClusterReachable.exchange(false))
+          {
+            gpCentral->log((string)"cluster() error:  Unable to reach the coordinator.  " + strError, strError);
+          }
+        }
+        strError.clear();
       }
-      ptBridge->ptInfo->insert("IP", szIP);
-      ptBridge->nThrottle = atoi(request["Throttle"].c_str());
-      ptBridge->fdIncoming = fdSocket;
-      ptBridge->fdOutgoing = -1;
-      time(&(ptBridge->CStartTime));
-      mutexLoad.lock();
-      loadBridge.push_back(ptBridge);
-      mutexLoad.unlock();
+      delete ptRequest;
     }
-    request.clear();
+    else if (fdSocket != -1)
+    {
+      close(fdSocket);
+      fdSocket = -1;
+    }
+    gpCentral->utility()->msleep(250);
   }
-  if (!bValid)
+  if (fdSocket != -1)
   {
     close(fdSocket);
   }
 }
 // }}}
-// {{{ sighandle()
-void sighandle(const int nSignal)
+// {{{ configure()
+void configure()
 {
-  string strError, strSignal;
-  stringstream ssSignal;
+  Json *ptConf = gpCentral->utility()->conf();
 
-  sethandles(sigdummy);
-  gbShutdown = true;
-  if (nSignal != SIGINT && nSignal != SIGTERM)
+  gbCluster = (ptConf->m.find("Cluster") != ptConf->m.end() && ptConf->m["Cluster"]->m.find("Coordinator") != ptConf->m["Cluster"]->m.end() && !ptConf->m["Cluster"]->m["Coordinator"]->v.empty());
+  gnNodes = 1;
+  if (gbCluster && ptConf->m["Cluster"]->m.find("Nodes") != ptConf->m["Cluster"]->m.end() && atoi(ptConf->m["Cluster"]->m["Nodes"]->v.c_str()) > 0)
+  {
+    gnNodes = atoi(ptConf->m["Cluster"]->m["Nodes"]->v.c_str());
+  }
+  gunGlobalThrottle = 0;
+  if (ptConf->m.find("Global Throttle") != ptConf->m.end() && atoi(ptConf->m["Global Throttle"]->v.c_str()) > 0)
+  {
+    gunGlobalThrottle = atoi(ptConf->m["Global Throttle"]->v.c_str());
+  }
+  // the scheduler count is fixed at startup, so a Global Throttle added later cannot be shared fairly across shards
+  if (shards.size() > 1 && gunGlobalThrottle > 0)
+  {
+    if (!gbSharded)
+    {
+      string strError;
+      gbSharded = true;
+      gpCentral->alert("Global Throttle was configured while running multiple schedulers.  The Global Throttle is enforced but Weights are only honored within each scheduler until the daemon is restarted.", strError);
+    }
+  }
+  else
+  {
+    gbSharded = false;
+  }
+}
+// }}}
+// {{{ coordinate()
+void coordinate(int fdSocket)
+{
+  bool bExit = false;
+  string strError, strLine;
+
+  while (!bExit && !gbShutdown && gpCentral->utility()->getLine(fdSocket, strLine))
+  {
+    stringstream ssResponse;
+    Json *ptConf = gpCentral->utility()->conf(), *ptRequest = new Json(strLine), *ptResponse = new Json;
+    if (ptRequest->m.find("Node") != ptRequest->m.end() && !ptRequest->m["Node"]->v.empty() && ptRequest->m.find("Services") != ptRequest->m.end())
+    {
+      string strNode = ptRequest->m["Node"]->v;
+      stringstream ssLease;
+      time_t CLease = LEASE, CTime;
+      if (ptConf->m.find("Cluster") != ptConf->m.end() && ptConf->m["Cluster"]->m.find("Lease") != ptConf->m["Cluster"]->m.end() && atoi(ptConf->m["Cluster"]->m["Lease"]->v.c_str()) > 0)
+      {
+        CLease = atoi(ptConf->m["Cluster"]->m["Lease"]->v.c_str());
+      }
+      time(&CTime);
+      ssLease << CLease;
+      ptResponse->insert("Lease", ssLease.str(), 'n');
+      ptResponse->m["Services"] = new Json;
+      mutexClaim.lock();
+      for (auto &i : ptRequest->m["Services"]->m)
+      {
+        list<map<string, claim *>::iterator> removeClaim;
+        size_t unActive = 0, unGrant, unOthers = 0, unThrottle = 0, unWant = 0, unWanted = 0;
+        stringstream ssGrant;
+        if (i.second->m.find("Active") != i.second->m.end())
+        {
+          unActive = atoi(i.second->m["Active"]->v.c_str());
+        }
+        if (i.second->m.find("Throttle") != i.second->m.end())
+        {
+          unThrottle = atoi(i.second->m["Throttle"]->v.c_str());
+        }
+        if (i.second->m.find("Want") != i.second->m.end())
+        {
+          unWant = atoi(i.second->m["Want"]->v.c_str());
+        }
+        for (auto j = claims[i.first].begin(); j != claims[i.first].end(); j++)
+        {
+          if (j->first != strNode)
+          {
+            // an expired claim belongs to a node that stopped renewing
+            if (CTime > j->second->CExpire)
+            {
+              delete j->second;
+              removeClaim.push_back(j);
+            }
+            else
+            {
+              unOthers += max(j->second->unGrant, j->second->unActive);
+              unWanted += j->second->unWant;
+            }
+          }
+        }
+        for (auto &j : removeClaim)
+        {
+          claims[i.first].erase(j);
+        }
+        removeClaim.clear();
+        unGrant = min(unWant, ((unThrottle > unOthers)?(unThrottle - unOthers):0));
+        if ((unWanted + unWant) > unThrottle)
+        {
+          unGrant = min(unGrant, max(unActive, max((size_t)1, unThrottle * unWant / (unWanted + unWant))));
+        }
+        if (unWant == 0 && unActive == 0)
+        {
+          if (claims[i.first].find(strNode) != claims[i.first].end())
+          {
+            delete claims[i.first][strNode];
+            claims[i.first].erase(strNode);
+          }
+        }
+        else
+        {
+          if (claims[i.first].find(strNode) == claims[i.first].end())
+          {
+            claims[i.first][strNode] = new claim;
+          }
+          claims[i.first][strNode]->unActive = unActive;
+          claims[i.first][strNode]->unGrant = unGrant;
+          claims[i.first][strNode]->unWant = unWant;
+          claims[i.first][strNode]->CExpire = CTime + CLease;
+        }
+        if (claims[i.first].empty())
+        {
+          claims.erase(i.first);
+        }
+        ssGrant << unGrant;
+        ptResponse->m["Services"]->insert(i.first, ssGrant.str(), 'n');
+      }
+      mutexClaim.unlock();
+    }
+    ssResponse << ptResponse << endl;
+    delete ptRequest;
+    delete ptResponse;
+    if (!transmit(fdSocket, ssResponse.str()))
+    {
+      bExit = true;
+    }
+  }
+  close(fdSocket);
+}
+// }}}
+// {{{ coordinator()
+void coordinator()
+{
+  int nReturn;
+  string strError, strPort = CLUSTER;
+  struct addrinfo hints, *result;
+  Json *ptConf = gpCentral->utility()->conf();
+
+  if (ptConf->m.find("Cluster") != ptConf->m.end() && ptConf->m["Cluster"]->m.find("Port") != ptConf->m["Cluster"]->m.end() && !ptConf->m["Cluster"]->m["Port"]->v.empty())
+  {
+    strPort = ptConf->m["Cluster"]->m["Port"]->v;
+  }
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_family = AF_INET6;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  if ((nReturn = getaddrinfo(NULL, strPort.c_str(), &hints, &result)) == 0)
+  {
+    bool bBound = false, bSocket = false;
+    int fdSocket;
+    struct addrinfo *rp;
+    for (rp = result; !bBound && rp != NULL; rp = rp->ai_next)
+    {
+      if ((fdSocket = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol)) >= 0)
+      {
+        int nOn = 1;
+        bSocket = true;
+        setsockopt(fdSocket, SOL_SOCKET, SO_REUSEADDR, (char *)&nOn, sizeof(nOn));
+        if (bind(fdSocket, rp->ai_addr, rp->ai_addrlen) == 0)
+        {
+          bBound = true;
+        }
+        else
+        {
+          close(fdSocket);
+        }
+      }
+    }
+    freeaddrinfo(result);
+    if (bBound)
+    {
+      if (listen(fdSocket, SOMAXCONN) == 0)
+      {
+        int fdNode;
+        socklen_t clilen;
+        sockaddr_in6 cli_addr;
+        gpCentral->log((string)"Listening to the coordinator socket.", strError);
+        clilen = sizeof(cli_addr);
+        while (!gbShutdown && (fdNode = accept(fdSocket, (sockaddr *)&cli_addr, &clilen)) >= 0)
+        {
+          thread tThread(coordinate, fdNode);
+          pthread_setname_np(tThread.native_handle(), "coordinate");
+          tThread.detach();
+        }
+      }
+      else
+      {
+        gpCentral->alert((string)"coordinator()->listen() error:  " + (string)strerror(errno), strError);
+      }
+      close(fdSocket);
+    }
+    else if (!bSocket)
+    {
+      gpCentral->alert((string)"coordinator()->socket() error:  " + (string)strerror(errno), strError);
+    }
+    else
+    {
+      gpCentral->alert((string)"coordinator()->bind() error:  " + (string)strerror(errno), strError);
+    }
+  }
+  else
+  {
+    gpCentral->alert((string)"coordinator()->getaddrinfo():  " + (string)gai_strerror(nReturn), strError);
+  }
+}
+// }}}
+// {{{ digest()
+size_t digest(const string strValue)
+{
+  uint64_t unHash = 14695981039346656037ULL;
+
+  for (auto &i : strValue)
+  {
+    unHash ^= (unsigned char)i;
+    unHash *= 1099511628211ULL;
+  }
+
+  return unHash;
+}
+// }}}
+// {{{ evict()
+bool evict()
+{
+  bool bEvicted = false;
+  list<connection *>::iterator iOldest;
+  pool *ptOldest = NULL;
+
+  for (auto &i : pools)
+  {
+    for (auto j = i.second->idle.begin(); j != i.second->idle.end(); j++)
+    {
+      if (ptOldest == NULL || (*j)->CTime < (*iOldest)->CTime)
+      {
+        iOldest = j;
+        ptOldest = i.second;
+      }
+    }
+  }
+  if (ptOldest != NULL)
+  {
+    bEvicted = true;
+    close((*iOldest)->fdSocket);
+    delete (*iOldest);
+    ptOldest->idle.erase(iOldest);
+    ptOldest->unOpen--;
+    vacate(1);
+  }
+
+  return bEvicted;
+}
+// }}}
+// {{{ exchange()
+bool exchange(bridge *ptBridge, connection *ptConnection, const string strRequest, string &strResponse, string &strError)
+{
+  bool bResult = false;
+  char szBuffer[65536];
+  int nReturn;
+  size_t unPosition, unSent = 0;
+  time_t CTime[2];
+
+  time(&(CTime[0]));
+  while (strError.empty() && unSent < strRequest.size())
+  {
+    if ((nReturn = write(ptConnection->fdSocket, strRequest.c_str() + unSent, strRequest.size() - unSent)) > 0)
+    {
+      ptBridge->unOutSend += nReturn;
+      unSent += nReturn;
+    }
+    else
+    {
+      strError = (string)"exchange()->write() error:  " + (string)strerror(errno);
+    }
+  }
+  while (strError.empty() && !bResult)
+  {
+    if ((unPosition = ptConnection->strBuffer.find("\n")) != string::npos)
+    {
+      bResult = true;
+      strResponse.append(ptConnection->strBuffer, 0, unPosition + 1);
+      ptConnection->strBuffer.erase(0, unPosition + 1);
+    }
+    else
+    {
+      pollfd fds[1];
+      fds[0].fd = ptConnection->fdSocket;
+      fds[0].events = POLLIN;
+      if ((nReturn = poll(fds, 1, 250)) > 0)
+      {
+        if ((nReturn = read(ptConnection->fdSocket, szBuffer, 65536)) > 0)
+        {
+          ptBridge->unOutRecv += nReturn;
+          ptConnection->strBuffer.append(szBuffer, nReturn);
+        }
+        else if (nReturn == 0)
+        {
+          strError = "exchange()->read() error:  Connection closed by server.";
+        }
+        else
+        {
+          strError = (string)"exchange()->read() error:  " + (string)strerror(errno);
+        }
+      }
+      else if (nReturn < 0)
+      {
+        strError = (string)"poll() error:  " + (string)strerror(errno);
+      }
+      time(&(CTime[1]));
+      if (strError.empty() && (CTime[1] - CTime[0]) > 600)
+      {
+        strError = "error:  Exceeded 10 minute timeout.";
+      }
+    }
+  }
+
+  return bResult;
+}
+// }}}
+// {{{ fits()
+bool fits(service *ptService, bridge *ptBridge)
+{
+  return ((int)ptService->active.size() < ptBridge->nThrottle && (ptService->nGrant < 0 || (int)ptService->active.size() < ptService->nGrant));
+}
+// }}}
+// {{{ launch()
+size_t launch(service *ptService, const size_t unLimit)
+{
+  size_t unLaunched = 0;
+  list<list<bridge *>::iterator> removeQueue;
+
+  for (auto i = ptService->queue.begin(); i != ptService->queue.end(); i++)
+  {
+    // multiplexed bridges are throttled per request by their pool instead
+    if ((*i)->bMultiplex || (unLaunched < unLimit && fits(ptService, (*i))))
+    {
+      if (!(*i)->bMultiplex)
+      {
+        unLaunched++;
+      }
+      time(&((*i)->CActiveTime));
+      (*i)->iActive = ptService->active.insert(ptService->active.end(), *i);
+      thread tThread(active, (*i));
+      pthread_setname_np(tThread.native_handle(), "active");
+      tThread.detach();
+      removeQueue.push_back(i);
+    }
+  }
+  for (auto &i : removeQueue)
+  {
+    ptService->queue.erase(i);
+  }
+  removeQueue.clear();
+
+  return unLaunched;
+}
+// }}}
+// {{{ lookup()
+pool *lookup(const string strService)
+{
+  pool *ptPool;
+
+  mutexPool.lock();
+  if (pools.find(strService) == pools.end())
+  {
+    ptPool = new pool;
+    ptPool->nGrant = -1;
+    ptPool->unOpen = 0;
+    ptPool->unWaiting = 0;
+    pools[strService] = ptPool;
+  }
+  ptPool = pools[strService];
+  mutexPool.unlock();
+
+  return ptPool;
+}
+// }}}
+// {{{ maintain()
+void maintain()
+{
+  while (!gbShutdown)
+  {
+    time_t CTime;
+    configure();
+    // {{{ idle multiplexed connections
+    time(&CTime);
+    mutexPool.lock();
+    for (auto &i : pools)
+    {
+      list<list<connection *>::iterator> removeIdle;
+      for (auto j = i.second->idle.begin(); j != i.second->idle.end(); j++)
+      {
+        if ((CTime - (*j)->CTime) > IDLE)
+        {
+          close((*j)->fdSocket);
+          delete (*j);
+          i.second->unOpen--;
+          vacate(1);
+          removeIdle.push_back(j);
+        }
+      }
+      for (auto &j : removeIdle)
+      {
+        i.second->idle.erase(j);
+      }
+      removeIdle.clear();
+    }
+    mutexPool.unlock();
+    // }}}
+    gpCentral->utility()->msleep(250);
+  }
+}
+// }}}
+// {{{ multiplex()
+void multiplex(bridge *ptBridge)
+{
+  bool bExit = false;
+  char szBuffer[65536];
+  int nReturn;
+  pool *ptPool;
+  size_t unPosition, unRequests = 0;
+  string strError;
+  stringstream ssRequests;
+  time_t CTime[2];
+
+  ptPool = lookup(ptBridge->ptInfo->m["Service"]->v);
+  time(&(CTime[0]));
+  while (!bExit)
+  {
+    // {{{ return the response
+    if (!ptBridge->strBuffer[0].empty())
+    {
+      if ((nReturn = write(ptBridge->fdIncoming, ptBridge->strBuffer[0].c_str(), ptBridge->strBuffer[0].size())) > 0)
+      {
+        ptBridge->unInSend += nReturn;
+        ptBridge->strBuffer[0].erase(0, nReturn);
+      }
+      else
+      {
+        bExit = true;
+        if (nReturn < 0)
+        {
+          strError = (string)"multiplex()->write() error:  " + (string)strerror(errno);
+        }
+      }
+    }
+    // }}}
+    // {{{ forward a complete request line
+    else if ((unPosition = ptBridge->strBuffer[1].find("\n")) != string::npos)
+    {
+      bool bExchanged = false, bRetry = false;
+      connection *ptConnection;
+      do
+      {
+        if ((ptConnection = borrow(ptBridge, ptPool, bRetry, strError)) != NULL)
+        {
+          bool bReused = ptConnection->bReused;
+          bExchanged = exchange(ptBridge, ptConnection, ptBridge->strBuffer[1].substr(0, unPosition + 1), ptBridge->strBuffer[0], strError);
+          // a kept-alive connection the server closed before any response arrived is retried once on a new connection
+          if (!bExchanged && !bRetry && bReused && ptConnection->strBuffer.empty() && strError != "error:  Exceeded 10 minute timeout.")
+          {
+            bRetry = true;
+            strError.clear();
+          }
+          else
+          {
+            bRetry = false;
+          }
+          // leftover bytes would be handed to the next client as its response
+          release(ptPool, ptConnection, (bExchanged && ptConnection->strBuffer.empty()));
+        }
+        else
+        {
+          bRetry = false;
+        }
+      } while (bRetry);
+      if (bExchanged)
+      {
+        unRequests++;
+        ptBridge->strBuffer[1].erase(0, unPosition + 1);
+      }
+      else
+      {
+        bExit = true;
+      }
+    }
+    // }}}
+    // {{{ wait for the next request
+    else
+    {
+      pollfd fds[1];
+      fds[0].fd = ptBridge->fdIncoming;
+      fds[0].events = POLLIN;
+      if ((nReturn = poll(fds, 1, 250)) > 0)
+      {
+        if ((nReturn = read(ptBridge->fdIncoming, szBuffer, 65536)) > 0)
+        {
+          ptBridge->unInRecv += nReturn;
+          ptBridge->strBuffer[1].append(szBuffer, nReturn);
+        }
+        else
+        {
+          bExit = true;
+          if (nReturn < 0)
+          {
+            strError = (string)"multiplex()->read() error:  " + (string)strerror(errno);
+          }
+        }
+      }
+      else if (nReturn < 0)
+      {
+        bExit = true;
+        strError = (string)"poll() error:  " + (string)strerror(errno);
+      }
+    }
+    // }}}
+    time(&(CTime[1]));
+    if (!bExit && (CTime[1] - CTime[0]) > 600)
+    {
+      bExit = true;
+      strError = "error:  Exceeded 10 minute timeout.";
+    }
+  }
+  ssRequests << unRequests;
+  ptBridge->ptInfo->insert("Requests", ssRequests.str(), 'n');
+  if (!strError.empty())
+  {
+    ptBridge->ptInfo->insert("Error", strError);
+  }
+}
+// }}}
+// {{{ outgoing()
+bool outgoing(bridge *ptBridge, int &fdSocket, string &strConnected, string &strError)
+{
+  bool bAddrInfo = false, bConnected = false, bSocket = false;
+  int nReturn;
+  list<string> serverGroup;
+
+  if (!ptBridge->strServer.empty())
+  {
+    serverGroup.push_back(ptBridge->strServer);
+  }
+  else
+  {
+    if (!ptBridge->strLoadBalancer.empty())
+    {
+      serverGroup.push_back(ptBridge->strLoadBalancer);
+    }
+    if (!ptBridge->strServiceJunction.empty())
+    {
+      serverGroup.push_back(ptBridge->strServiceJunction);
+    }
+  }
+  if (!serverGroup.empty())
+  {
+    for (auto i = serverGroup.begin(); !bConnected && i != serverGroup.end(); i++)
+    {
+      string strServer;
+      timeval tTimeVal;
+      unsigned int unAttempt = 0, unPick = 0, unSeed = time(NULL);
+      vector<string> server;
+      tTimeVal.tv_sec = 2;
+      tTimeVal.tv_usec = 0;
+      for (int j = 1; !gpCentral->manip()->getToken(strServer, (*i), j, ",", true).empty(); j++)
+      {
+        server.push_back(gpCentral->manip()->trim(strServer, strServer));
+      }
+      srand(unSeed);
+      unPick = rand_r(&unSeed) % server.size();
+      bAddrInfo = bSocket = false;
+      while (!bConnected && unAttempt++ < server.size())
+      {
+        struct addrinfo hints, *result;
+        if (unPick == server.size())
+        {
+          unPick = 0;
+        }
+        strServer = server[unPick];
+        memset(&hints, 0, sizeof(struct addrinfo));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = 0;
+        hints.ai_protocol = 0;
+        bAddrInfo = bSocket = false;
+        if ((nReturn = getaddrinfo(strServer.c_str(), ptBridge->strPort.c_str(), &hints, &result)) == 0)
+        {
+          struct addrinfo *rp;
+          bAddrInfo = true;
+          for (rp = result; !bConnected && rp != NULL; rp = rp->ai_next)
+          {
+            if ((fdSocket = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol)) >= 0)
+            {
+              bSocket = true;
+              setsockopt(fdSocket, SOL_SOCKET, SO_RCVTIMEO, &tTimeVal, sizeof(timeval));
+              if (connect(fdSocket, rp->ai_addr, rp->ai_addrlen) == 0)
+              {
+                bConnected = true;
+                strConnected = strServer;
+              }
+              else
+              {
+                close(fdSocket);
+              }
+            }
+          }
+          freeaddrinfo(result);
+        }
+        unPick++;
+      }
+    }
+    serverGroup.clear();
+  }
+  if (!bConnected)
+  {
+    stringstream ssMessage;
+    if (!bAddrInfo)
+    {
+      ssMessage << "getaddrinfo() error:  " << gai_strerror(nReturn);
+    }
+    else
+    {
+      if (!bSocket)
+      {
+        ssMessage << "socket()";
+      }
+      else
+      {
+        ssMessage << "connect()";
+      }
+      ssMessage << ":  " << strerror(errno);
+    }
+    strError = ssMessage.str();
+  }
+
+  return bConnected;
+}
+// }}}
+// {{{ queue()
+void queue(int fdSocket)
+{
+  bool bValid = false;
+  char szIP[INET6_ADDRSTRLEN];
+  sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  string strRequest;
+
+  getpeername(fdSocket, (sockaddr*)&addr, &len);
+  if (addr.ss_family == AF_INET)
+  {
+    sockaddr_in *s = (sockaddr_in *)&addr;
+    inet_ntop(AF_INET, &s->sin_addr, szIP, sizeof(szIP));
+  }
+  else if (addr.ss_family == AF_INET6)
+  {
+    sockaddr_in6 *s = (sockaddr_in6 *)&addr;
+    inet_ntop(AF_INET6, &s->sin6_addr, szIP, sizeof(szIP));
+  }
+  if (gpCentral->utility()->getLine(fdSocket, strRequest))
+  {
+    map<string, string> request;
+    Json *ptConf = gpCentral->utility()->conf(), *ptJson = new Json(strRequest);
+    ptJson->flatten(request, true, false);
+    delete ptJson;
+    if (request.find("Service") != request.end() && !request["Service"].empty() && request.find("Throttle") != request.end() && !request["Throttle"].empty() && atoi(request["Throttle"].c_str()) > 0 && (request.find("Server") == request.end() || request["Server"].empty() || (request.find("Port") != request.end() && !request["Port"].empty())))
+    {
+      bridge *ptBridge = new bridge;
+      bValid = true;
+      ptBridge->bMultiplex = false;
+      ptBridge->unInRecv = 0;
+      ptBridge->unInSend = 0;
+      ptBridge->unOutRecv = 0;
+      ptBridge->unOutSend = 0;
+      ptBridge->ptInfo = new Json(request);
+      if (request.find("Server") != request.end() && !request["Server"].empty())
+      {
+        ptBridge->strServer = request["Server"];
+        ptBridge->strPort = request["Port"];
+      }
+      else
+      {
+        if (ptConf->m.find("Load Balancer") != ptConf->m.end() && !ptConf->m["Load Balancer"]->v.empty())
+        {
+          ptBridge->strLoadBalancer = ptConf->m["Load Balancer"]->v;
+        }
+        if (ptConf->m.find("Service Junction") != ptConf->m.end() && !ptConf->m["Service Junction"]->v.empty())
+        {
+          ptBridge->strServiceJunction = ptConf->m["Service Junction"]->v;
+        }
+        ptBridge->strPort = "5864";
+        if (ptConf->m.find("Multiplex") != ptConf->m.end())
+        {
+          for (auto &i : ptConf->m["Multiplex"]->l)
+          {
+            if (i->v == request["Service"])
+            {
+              ptBridge->bMultiplex = true;
+            }
+          }
+        }
+      }
+      ptBridge->ptInfo->insert("IP", szIP);
+      ptBridge->nThrottle = atoi(request["Throttle"].c_str());
+      ptBridge->fdIncoming = fdSocket;
+      ptBridge->fdOutgoing = -1;
+      ptBridge->unShard = digest(request["Service"]) % shards.size();
+      time(&(ptBridge->CStartTime));
+      shards[ptBridge->unShard]->mutexShard.lock();
+      shards[ptBridge->unShard]->load.push_back(ptBridge);
+      shards[ptBridge->unShard]->mutexShard.unlock();
+      shards[ptBridge->unShard]->condition.notify_one();
+    }
+    request.clear();
+  }
+  if (!bValid)
+  {
+    close(fdSocket);
+  }
+}
+// }}}
+// {{{ release()
+void release(pool *ptPool, connection *ptConnection, const bool bReuse)
+{
+  int nGrant = ptPool->nGrant;
+
+  mutexPool.lock();
+  // connections beyond a shrunken cluster grant are closed rather than kept idle
+  if (bReuse && (nGrant < 0 || (int)ptPool->unOpen <= nGrant))
+  {
+    time(&(ptConnection->CTime));
+    ptPool->idle.push_back(ptConnection);
+  }
+  else
+  {
+    close(ptConnection->fdSocket);
+    delete ptConnection;
+    ptPool->unOpen--;
+    vacate(1);
+  }
+  conditionPool.notify_all();
+  mutexPool.unlock();
+}
+// }}}
+// {{{ reserve()
+size_t reserve(const size_t unWant, const size_t unCapacity)
+{
+  size_t unOutgoing = gunOutgoing, unReserved;
+
+  do
+  {
+    unReserved = ((unOutgoing < unCapacity)?min(unWant, unCapacity - unOutgoing):0);
+  } while (unReserved > 0 && !gunOutgoing.compare_exchange_weak(unOutgoing, unOutgoing + unReserved));
+
+  return unReserved;
+}
+// }}}
+// {{{ sighandle()
+void sighandle(const int nSignal)
+{
+  string strError, strSignal;
+  stringstream ssSignal;
+
+  sethandles(sigdummy);
+  gbShutdown = true;
+  if (nSignal != SIGINT && nSignal != SIGTERM)
   {
     ssSignal << nSignal;
     gpCentral->notify("", (string)"The program's signal handling caught a " + (string)sigstring(strSignal, nSignal) + (string)"(" + ssSignal.str() + (string)")!  Exiting...", strError);
@@ -630,22 +1721,38 @@ void sighandle(const int nSignal)
 }
 // }}}
 // {{{ throttle()
-void throttle()
+void throttle(const size_t unShard)
 {
   string strError;
+  shard *ptShard = shards[unShard];
 
   while (!gbShutdown)
   {
     bool bUpdated = false;
-    list<map<string, service *>::iterator> removeService;
-    mutexLoad.lock();
-    while (!loadBridge.empty())
+    list<bridge *> completed, load;
+    list<unordered_map<string, service *>::iterator> removeService;
+    size_t unFreed = gunFreed, unGlobalThrottle = gunGlobalThrottle, unVacated = 0;
+    ptShard->mutexShard.lock();
+    completed.swap(ptShard->completed);
+    load.swap(ptShard->load);
+    ptShard->mutexShard.unlock();
+    // {{{ load
+    for (auto &ptBridge : load)
     {
-      bridge *ptBridge = loadBridge.front();
-      if (services.find(ptBridge->ptInfo->m["Service"]->v) == services.end())
+      auto i = ptShard->services.find(ptBridge->ptInfo->m["Service"]->v);
+      if (i == ptShard->services.end())
       {
         service *ptService = new service;
-        services[ptBridge->ptInfo->m["Service"]->v] = ptService;
+        Json *ptConf = gpCentral->utility()->conf();
+        ptService->nGrant = -1;
+        ptService->ptPool = NULL;
+        ptService->unDeficit = 0;
+        ptService->unWeight = 1;
+        if (ptConf->m.find("Weights") != ptConf->m.end() && ptConf->m["Weights"]->m.find(ptBridge->ptInfo->m["Service"]->v) != ptConf->m["Weights"]->m.end() && atoi(ptConf->m["Weights"]->m[ptBridge->ptInfo->m["Service"]->v]->v.c_str()) > 0)
+        {
+          ptService->unWeight = atoi(ptConf->m["Weights"]->m[ptBridge->ptInfo->m["Service"]->v]->v.c_str());
+        }
+        i = ptShard->services.insert(make_pair(ptBridge->ptInfo->m["Service"]->v, ptService)).first;
       }
       if (ptBridge->ptInfo->m.find("Duration") != ptBridge->ptInfo->m.end())
       {
@@ -664,70 +1771,222 @@ void throttle()
       ptBridge->ptInfo->m["Transfer"] = new Json;
       ptBridge->ptInfo->m["Transfer"]->m["In"] = new Json;
       ptBridge->ptInfo->m["Transfer"]->m["Out"] = new Json;
-      services[ptBridge->ptInfo->m["Service"]->v]->queue.push_back(ptBridge);
-      loadBridge.pop_front();
-    }
-    mutexLoad.unlock();
-    for (auto i = services.begin(); i != services.end(); i++)
-    {
-      list<list<bridge *>::iterator> removeActive, removeQueue;
-      size_t nActive = i->second->active.size(), nQueue = i->second->queue.size();
-      for (auto j = i->second->active.begin(); j != i->second->active.end(); j++)
-      {
-        if ((*j)->bDone)
-        {
-          stringstream ssDurationActive, ssDurationQueue, ssInRecv, ssInSend, ssLoadActive, ssLoadQueue, ssMessage, ssOutRecv, ssOutSend;
-          time(&((*j)->CEndTime));
-          ssDurationActive << ((*j)->CEndTime - (*j)->CActiveTime);
-          (*j)->ptInfo->m["Duration"]->insert("Active", ssDurationActive.str(), 'n');
-          ssDurationQueue << ((*j)->CActiveTime - (*j)->CStartTime);
-          (*j)->ptInfo->m["Duration"]->insert("Queue", ssDurationQueue.str(), 'n');
-          ssLoadActive << (nActive - removeActive.size() - 1);
-          (*j)->ptInfo->m["Load"]->insert("Active", ssLoadActive.str(), 'n');
-          ssLoadQueue << nQueue;
-          (*j)->ptInfo->m["Load"]->insert("Queue", ssLoadQueue.str(), 'n');
-          ssInRecv << (*j)->unInRecv;
-          (*j)->ptInfo->m["Transfer"]->m["In"]->insert("Recv", ssInRecv.str(), 'n');
-          ssInSend << (*j)->unInSend;
-          (*j)->ptInfo->m["Transfer"]->m["In"]->insert("Send", ssInSend.str(), 'n');
-          ssOutRecv << (*j)->unOutRecv;
-          (*j)->ptInfo->m["Transfer"]->m["Out"]->insert("Recv", ssOutRecv.str(), 'n');
-          ssOutSend << (*j)->unOutSend;
-          (*j)->ptInfo->m["Transfer"]->m["Out"]->insert("Send", ssOutSend.str(), 'n');
-          ssMessage << (*j)->ptInfo;
-          if ((*j)->ptInfo->m.find("Error") != (*j)->ptInfo->m.end() && !(*j)->ptInfo->m["Error"]->v.empty())
-          {
-            ssMessage << ":  " << (*j)->ptInfo->m["Error"]->v;
-          }
-          gpCentral->log(ssMessage.str(), strError);
-          delete (*j)->ptInfo;
-          delete (*j);
-          removeActive.push_back(j);
+      i->second->bMultiplex = ptBridge->bMultiplex;
+      i->second->nThrottle = ptBridge->nThrottle;
+      if (ptBridge->bMultiplex && i->second->ptPool == NULL)
+      {
+        i->second->ptPool = lookup(i->first);
+      }
+      i->second->queue.push_back(ptBridge);
+    }
+    load.clear();
+    // }}}
+    // {{{ completed
+    for (auto &ptBridge : completed)
+    {
+      stringstream ssDurationActive, ssDurationQueue, ssInRecv, ssInSend, ssLoadActive, ssLoadQueue, ssMessage, ssOutRecv, ssOutSend;
+      service *ptService = ptShard->services[ptBridge->ptInfo->m["Service"]->v];
+      ptService->active.erase(ptBridge->iActive);
+      if (!ptBridge->bMultiplex)
+      {
+        unVacated++;
+      }
+      time(&(ptBridge->CEndTime));
+      ssDurationActive << (ptBridge->CEndTime - ptBridge->CActiveTime);
+      ptBridge->ptInfo->m["Duration"]->insert("Active", ssDurationActive.str(), 'n');
+      ssDurationQueue << (ptBridge->CActiveTime - ptBridge->CStartTime);
+      ptBridge->ptInfo->m["Duration"]->insert("Queue", ssDurationQueue.str(), 'n');
+      ssLoadActive << ptService->active.size();
+      ptBridge->ptInfo->m["Load"]->insert("Active", ssLoadActive.str(), 'n');
+      ssLoadQueue << ptService->queue.size();
+      ptBridge->ptInfo->m["Load"]->insert("Queue", ssLoadQueue.str(), 'n');
+      ssInRecv << ptBridge->unInRecv;
+      ptBridge->ptInfo->m["Transfer"]->m["In"]->insert("Recv", ssInRecv.str(), 'n');
+      ssInSend << ptBridge->unInSend;
+      ptBridge->ptInfo->m["Transfer"]->m["In"]->insert("Send", ssInSend.str(), 'n');
+      ssOutRecv << ptBridge->unOutRecv;
+      ptBridge->ptInfo->m["Transfer"]->m["Out"]->insert("Recv", ssOutRecv.str(), 'n');
+      ssOutSend << ptBridge->unOutSend;
+      ptBridge->ptInfo->m["Transfer"]->m["Out"]->insert("Send", ssOutSend.str(), 'n');
+      ssMessage << ptBridge->ptInfo;
+      if (ptBridge->ptInfo->m.find("Error") != ptBridge->ptInfo->m.end() && !ptBridge->ptInfo->m["Error"]->v.empty())
+      {
+        ssMessage << ":  " << ptBridge->ptInfo->m["Error"]->v;
+      }
+      gpCentral->log(ssMessage.str(), strError);
+      delete ptBridge->ptInfo;
+      delete ptBridge;
+    }
+    completed.clear();
+    vacate(unVacated);
+    // }}}
+    // {{{ cluster leases
+    if (gbCluster)
+    {
+      int nNodes = gnNodes;
+      time_t CTime;
+      time(&CTime);
+      ptShard->mutexLease.lock();
+      for (auto &i : ptShard->leases)
+      {
+        if (ptShard->services.find(i.first) == ptShard->services.end())
+        {
+          i.second->unActive = i.second->unDemand = 0;
+        }
+      }
+      for (auto &i : ptShard->services)
+      {
+        lease *ptLease;
+        if (ptShard->leases.find(i.first) == ptShard->leases.end())
+        {
+          ptLease = new lease;
+          ptLease->unGrant = ptLease->unRequested = ptLease->unWant = 0;
+          ptLease->CExpire = 0;
+          ptLease->CUsed = CTime;
+          ptShard->leases[i.first] = ptLease;
+        }
+        ptLease = ptShard->leases[i.first];
+        ptLease->nThrottle = i.second->nThrottle;
+        // a multiplexed service holds pooled connections and wants one more for every request waiting on its pool
+        if (i.second->ptPool != NULL)
+        {
+          ptLease->unActive = i.second->ptPool->unOpen;
+          ptLease->unDemand = ptLease->unActive + i.second->ptPool->unWaiting;
+        }
+        else
+        {
+          ptLease->unActive = ptLease->unDemand = 0;
+        }
+        if (!i.second->bMultiplex)
+        {
+          ptLease->unActive += i.second->active.size();
+          ptLease->unDemand += i.second->active.size() + i.second->queue.size();
+        }
+        if (ptLease->unDemand > 0)
+        {
+          ptLease->CUsed = CTime;
+        }
+        if (CTime < ptLease->CExpire)
+        {
+          i.second->nGrant = ptLease->unGrant;
+        }
+        // without a coordinator each node falls back to its share of the throttle
+        else if (!gbClusterReachable)
+        {
+          i.second->nGrant = max(1, i.second->nThrottle / nNodes);
+        }
+        else
+        {
+          i.second->nGrant = 0;
+        }
+        if (i.second->ptPool != NULL)
+        {
+          i.second->ptPool->nGrant = i.second->nGrant;
         }
       }
-      for (auto &j : removeActive)
+      ptShard->mutexLease.unlock();
+    }
+    else
+    {
+      for (auto &i : ptShard->services)
       {
-        i->second->active.erase(j);
+        i.second->nGrant = -1;
+        if (i.second->ptPool != NULL)
+        {
+          i.second->ptPool->nGrant = -1;
+        }
       }
-      removeActive.clear();
-      for (auto j = i->second->queue.begin(); j != i->second->queue.end(); j++)
+    }
+    // }}}
+    // {{{ queued
+    if (unGlobalThrottle == 0)
+    {
+      for (auto &i : ptShard->services)
       {
-        if ((int)i->second->active.size() < (*j)->nThrottle)
+        size_t unLaunched = launch(i.second, string::npos);
+        if (unLaunched > 0)
         {
+          gunOutgoing += unLaunched;
           bUpdated = true;
-          time(&((*j)->CActiveTime));
-          i->second->active.push_back(*j);
-          thread tThread(active, (*j));
-          pthread_setname_np(tThread.native_handle(), "active");
-          tThread.detach();
-          removeQueue.push_back(j);
         }
       }
-      for (auto &j : removeQueue)
+    }
+    else if (!ptShard->services.empty())
+    {
+      bool bFull = false;
+      size_t unIdle = 0;
+      auto i = ptShard->services.find(ptShard->strRound);
+      // deficit round-robin:  the cursor stays on a service until its weight
+      // worth of bridges is launched or it has nothing eligible, and a service
+      // is only credited when the cursor reaches it so that freed global slots
+      // are shared in proportion to weight rather than in map order
+      if (i == ptShard->services.end())
+      {
+        i = ptShard->services.begin();
+        i->second->unDeficit = i->second->unWeight;
+        ptShard->strRound = i->first;
+      }
+      while (!bFull && unIdle <= ptShard->services.size())
       {
-        i->second->queue.erase(j);
+        size_t unLaunched = 0, unReserved;
+        // slots are reserved up front because other shards and the pools admit against the same total
+        unReserved = reserve(i->second->unDeficit, unGlobalThrottle);
+        if (unReserved == 0 && i->second->unDeficit > 0)
+        {
+          bool bWaiting = false;
+          for (auto j = i->second->queue.begin(); !bWaiting && j != i->second->queue.end(); j++)
+          {
+            if (!(*j)->bMultiplex && fits(i->second, (*j)))
+            {
+              bWaiting = true;
+            }
+          }
+          // an idle multiplexed connection gives up its slot to a waiting bridge
+          if (bWaiting)
+          {
+            mutexPool.lock();
+            if (evict())
+            {
+              unReserved = reserve(i->second->unDeficit, unGlobalThrottle);
+            }
+            mutexPool.unlock();
+            if (unReserved == 0)
+            {
+              bFull = true;
+            }
+          }
+        }
+        if (!bFull)
+        {
+          unLaunched = launch(i->second, unReserved);
+          // an unused reservation was never free to anyone else, so it does not wake the shards
+          gunOutgoing -= (unReserved - unLaunched);
+          i->second->unDeficit -= unLaunched;
+          if (unLaunched > 0)
+          {
+            bUpdated = true;
+            unIdle = 0;
+          }
+          if (unLaunched < unReserved || unReserved == 0)
+          {
+            i->second->unDeficit = 0;
+          }
+          if (i->second->unDeficit == 0)
+          {
+            unIdle++;
+            if (++i == ptShard->services.end())
+            {
+              i = ptShard->services.begin();
+            }
+            i->second->unDeficit = i->second->unWeight;
+            ptShard->strRound = i->first;
+          }
+        }
       }
-      removeQueue.clear();
+    }
+    // }}}
+    for (auto i = ptShard->services.begin(); i != ptShard->services.end(); i++)
+    {
       if (i->second->active.empty() && i->second->queue.empty())
       {
         delete i->second;
@@ -736,12 +1995,58 @@ void throttle()
     }
     for (auto &i : removeService)
     {
-      services.erase(i);
+      ptShard->services.erase(i);
     }
     removeService.clear();
     if (!bUpdated)
     {
-      gpCentral->utility()->msleep(250);
+      unique_lock<mutex> lock(ptShard->mutexShard);
+      if (ptShard->completed.empty() && ptShard->load.empty() && unFreed == gunFreed)
+      {
+        ptShard->condition.wait_for(lock, chrono::milliseconds(250));
+      }
+    }
+  }
+}
+// }}}
+// {{{ transmit()
+bool transmit(int fdSocket, const string strLine)
+{
+  bool bResult = true;
+  int nReturn;
+  size_t unSent = 0;
+
+  while (bResult && unSent < strLine.size())
+  {
+    if ((nReturn = write(fdSocket, strLine.c_str() + unSent, strLine.size() - unSent)) > 0)
+    {
+      unSent += nReturn;
+    }
+    else
+    {
+      bResult = false;
+    }
+  }
+
+  return bResult;
+}
+// }}}
+// {{{ vacate()
+void vacate(const size_t unSlots)
+{
+  if (unSlots > 0)
+  {
+    gunOutgoing -= unSlots;
+    if (gunGlobalThrottle > 0)
+    {
+      gunFreed++;
+      // taking each shard mutex orders the bump before a waiting shard checks gunFreed
+      for (auto &i : shards)
+      {
+        i->mutexShard.lock();
+        i->mutexShard.unlock();
+        i->condition.notify_one();
+      }
     }
   }
 }